@@ -1,4 +1,5 @@
 #include "AudioSynesthesiaGameModeBase.h"
+#include "CubesAnalysisScheduler.h"
 // Fill out your copyright notice in the Description page of Project Settings.
 
 void AAudioSynesthesiaGameModeBase::CubeSpawnerDebugging(bool bShouldDebug)
@@ -11,3 +12,8 @@ void AAudioSynesthesiaGameModeBase::CubeSpawnerDebug(bool bShouldDebug)
 	bCubeSpawnerDebug = bShouldDebug;
 	OnCubeSpawnerDebugToggled.Broadcast(bCubeSpawnerDebug);
 }
+
+void AAudioSynesthesiaGameModeBase::CubeAnalysisBenchmark(int32 MaxSources, int32 NumPasses)
+{
+	FCubesAnalysisScheduler::RunBenchmark(MaxSources, NumPasses);
+}
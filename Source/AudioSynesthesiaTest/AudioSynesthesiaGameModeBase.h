@@ -44,4 +44,15 @@ private:
 	// The toggle for debugging the cube spawner elements
 	bool bCubeSpawnerDebug;
 #pragma endregion
+
+#pragma region Benchmarks
+public:
+	/**
+	* Log cube analysis throughput for 1, 2, 4... sources at 1, 2, 4... threads
+	* @param MaxSources The largest amount of sources to measure
+	* @param NumPasses Analysis passes per measurement
+	*/
+	UFUNCTION(Exec, Category = "Commands")
+	void CubeAnalysisBenchmark(int32 MaxSources = 16, int32 NumPasses = 200);
+#pragma endregion
 };
@@ -8,7 +8,7 @@ public class AudioSynesthesiaTest : ModuleRules
 	{
 		PCHUsage = PCHUsageMode.UseExplicitOrSharedPCHs;
 	
-		PublicDependencyModuleNames.AddRange(new string[] { "Core", "CoreUObject", "Engine", "InputCore" });
+		PublicDependencyModuleNames.AddRange(new string[] { "Core", "CoreUObject", "Engine", "InputCore", "SignalProcessing" });
 
 		PrivateDependencyModuleNames.AddRange(new string[] {  });
 
@@ -0,0 +1,24 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "CubeAnalysisBenchmarkCommandlet.h"
+#include "CubesAnalysisScheduler.h"
+
+UCubeAnalysisBenchmarkCommandlet::UCubeAnalysisBenchmarkCommandlet()
+{
+	IsClient = false;
+	IsServer = false;
+	IsEditor = false;
+	LogToConsole = true;
+}
+
+int32 UCubeAnalysisBenchmarkCommandlet::Main(const FString& Params)
+{
+	int32 MaxSources = 16;
+	int32 NumPasses = 200;
+	FParse::Value(*Params, TEXT("MaxSources="), MaxSources);
+	FParse::Value(*Params, TEXT("Passes="), NumPasses);
+
+	FCubesAnalysisScheduler::RunBenchmark(MaxSources, NumPasses);
+	return 0;
+}
@@ -0,0 +1,24 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Commandlets/Commandlet.h"
+
+#include "CubeAnalysisBenchmarkCommandlet.generated.h"
+
+/**
+* Headless run of FCubesAnalysisScheduler::RunBenchmark, no game world needed
+* Usage: UnrealEditor-Cmd AudioSynesthesiaTest.uproject -run=CubeAnalysisBenchmark -nullrhi [-MaxSources=16] [-Passes=200]
+* Each run sweeps 1, 2, 4... threads up to the task graph's workers; add -corelimit=N to measure on fewer cores.
+*/
+UCLASS()
+class AUDIOSYNESTHESIATEST_API UCubeAnalysisBenchmarkCommandlet : public UCommandlet
+{
+	GENERATED_BODY()
+
+public:
+	UCubeAnalysisBenchmarkCommandlet();
+
+	virtual int32 Main(const FString& Params) override;
+};
@@ -0,0 +1,568 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "CubesAnalysisScheduler.h"
+#include "CubesSpawner.h"
+#include "Async/ParallelFor.h"
+#include "Async/TaskGraphInterfaces.h"
+#include "AudioDevice.h"
+#include "AudioThread.h"
+#include "ISubmixBufferListener.h"
+#include "Sound/SoundSubmix.h"
+
+namespace CubesAnalysis
+{
+	// Band edges are spread logarithmically over this range
+	static constexpr float MinBandFrequency = 40.f;
+	static constexpr float MaxBandFrequency = 16000.f;
+
+	// Fallback when there's no audio device, matches AudioSampleRate in DefaultEngine.ini
+	static constexpr float DefaultSampleRate = 48000.f;
+}
+
+#pragma region Scheduler
+
+FCubesAnalysisScheduler::FAnalysisSource::FAnalysisSource(int32 InWindowSize, int32 InNumBands)
+	: Input(InWindowSize * 8)
+{
+	Window.SetNumZeroed(InWindowSize);
+	Spectrum.SetNumZeroed(InWindowSize + 2);
+	BandEdges.SetNumZeroed(InNumBands + 1);
+	Bands[0].SetNumZeroed(InNumBands);
+	Bands[1].SetNumZeroed(InNumBands);
+}
+
+FCubesAnalysisScheduler::FCubesAnalysisScheduler(float InSampleRate, int32 InMaxSources, int32 InWindowSize)
+	: SampleRate(InSampleRate)
+	, WindowSize((int32)FMath::RoundUpToPowerOfTwo((uint32)FMath::Max(InWindowSize, 64)))
+	, NumSources(0)
+{
+	Sources.SetNum(FMath::Max(InMaxSources, 1));
+
+	WindowTable.SetNumUninitialized(WindowSize);
+	WindowGain = 0.f;
+	for (int32 i = 0; i < WindowSize; ++i)
+	{
+		WindowTable[i] = 0.5f - 0.5f * FMath::Cos(UE_TWO_PI * i / (WindowSize - 1));
+		WindowGain += WindowTable[i];
+	}
+}
+
+FCubesAnalysisScheduler::~FCubesAnalysisScheduler()
+{
+	Wait();
+}
+
+int32 FCubesAnalysisScheduler::AddSource(int32 NumBands)
+{
+	check(!IsBusy());
+	NumBands = FMath::Max(NumBands, 1);
+
+	const int32 SourceId = Sources.IndexOfByPredicate([](const TUniquePtr<FAnalysisSource>& Source) { return !Source.IsValid(); });
+	if (SourceId == INDEX_NONE)
+	{
+		return INDEX_NONE;
+	}
+
+	TUniquePtr<FAnalysisSource> NewSource = MakeUnique<FAnalysisSource>(WindowSize, NumBands);
+
+	Audio::FFFTSettings FFTSettings;
+	FFTSettings.Log2Size = FMath::CeilLogTwo(WindowSize);
+	FFTSettings.bArrays128BitAligned = true;
+	FFTSettings.bEnableHardwareAcceleration = true;
+	NewSource->FFT = Audio::FFFTFactory::NewFFTAlgorithm(FFTSettings);
+	if (!NewSource->FFT.IsValid())
+	{
+		UE_LOG(LogTemp, Warning, TEXT("No %d point FFT available for cube analysis"), WindowSize);
+		return INDEX_NONE;
+	}
+
+	// Undo whatever scaling the FFT implementation applies, so bands normalize the same on every platform
+	switch (NewSource->FFT->ForwardScaling())
+	{
+	case Audio::EFFTScaling::MultipliedByFFTSize:
+		NewSource->PowerScale = 1.f / ((float)WindowSize * WindowSize);
+		break;
+	case Audio::EFFTScaling::MultipliedBySqrtFFTSize:
+		NewSource->PowerScale = 1.f / WindowSize;
+		break;
+	case Audio::EFFTScaling::DividedByFFTSize:
+		NewSource->PowerScale = (float)WindowSize * WindowSize;
+		break;
+	case Audio::EFFTScaling::DividedBySqrtFFTSize:
+		NewSource->PowerScale = (float)WindowSize;
+		break;
+	default:
+		NewSource->PowerScale = 1.f;
+		break;
+	}
+
+	// Logarithmically spaced band edges, rounded to bins. Skip DC and give every band at least one bin of its own,
+	// so narrow low bands don't collapse onto the same bin. Bands past Nyquist end up sharing the last bin.
+	const int32 NyquistBin = WindowSize / 2;
+	const float MaxFrequency = FMath::Min(CubesAnalysis::MaxBandFrequency, SampleRate * 0.5f);
+	const float FrequencyRatio = MaxFrequency / CubesAnalysis::MinBandFrequency;
+	for (int32 Edge = 0; Edge <= NumBands; ++Edge)
+	{
+		const float EdgeFrequency = CubesAnalysis::MinBandFrequency * FMath::Pow(FrequencyRatio, (float)Edge / NumBands);
+		int32 EdgeBin = FMath::Max(FMath::RoundToInt(EdgeFrequency * WindowSize / SampleRate), 1);
+		if (Edge > 0)
+		{
+			EdgeBin = FMath::Max(EdgeBin, NewSource->BandEdges[Edge - 1] + 1);
+		}
+		NewSource->BandEdges[Edge] = FMath::Min(EdgeBin, NyquistBin + 1);
+	}
+
+	Sources[SourceId] = MoveTemp(NewSource);
+	++NumSources;
+	return SourceId;
+}
+
+void FCubesAnalysisScheduler::RemoveSource(int32 SourceId)
+{
+	if (!Sources.IsValidIndex(SourceId) || !Sources[SourceId].IsValid())
+	{
+		return;
+	}
+	Wait();
+	Sources[SourceId].Reset();
+	--NumSources;
+}
+
+int32 FCubesAnalysisScheduler::PushAudio(int32 SourceId, const float* Samples, int32 NumSamples)
+{
+	if (!Sources.IsValidIndex(SourceId) || !Sources[SourceId].IsValid() || NumSamples <= 0)
+	{
+		return 0;
+	}
+	return (int32)Sources[SourceId]->Input.Push(Samples, (uint32)NumSamples);
+}
+
+const TArray<float>* FCubesAnalysisScheduler::GetBands(int32 SourceId) const
+{
+	if (!Sources.IsValidIndex(SourceId) || !Sources[SourceId].IsValid())
+	{
+		return nullptr;
+	}
+	const FAnalysisSource& Source = *Sources[SourceId];
+	return &Source.Bands[Source.FrontIndex];
+}
+
+int32 FCubesAnalysisScheduler::Analyze(int32 MaxConcurrency)
+{
+	// Take the newest window from every source that has enough audio, each ready source is one job
+	ReadySources.Reset();
+	for (const TUniquePtr<FAnalysisSource>& Source : Sources)
+	{
+		if (!Source.IsValid() || Source->bPendingPublish)
+		{
+			continue;
+		}
+		const uint32 NumAvailable = Source->Input.Num();
+		if (NumAvailable < (uint32)WindowSize)
+		{
+			continue;
+		}
+		// Skip whatever piled up while frames were slow, so the bands never lag behind the music
+		if (NumAvailable > (uint32)WindowSize)
+		{
+			Source->Input.Pop(NumAvailable - (uint32)WindowSize);
+		}
+		Source->Input.Pop(Source->Window.GetData(), (uint32)WindowSize);
+		ReadySources.Add(Source.Get());
+	}
+
+	// Capping the batch count caps how many threads pick up jobs at once
+	const int32 NumJobs = ReadySources.Num();
+	const int32 MinBatchSize = MaxConcurrency > 0 ? FMath::Max(FMath::DivideAndRoundUp(NumJobs, MaxConcurrency), 1) : 1;
+
+	// Jobs only touch their own source, so they need no synchronization
+	ParallelFor(TEXT("CubesAnalysis"), NumJobs, MinBatchSize, [this](int32 JobIndex)
+		{
+			AnalyzeSource(*ReadySources[JobIndex]);
+		}, MaxConcurrency == 1 ? EParallelForFlags::ForceSingleThread : EParallelForFlags::None);
+
+	for (FAnalysisSource* Source : ReadySources)
+	{
+		Source->bPendingPublish = true;
+	}
+	return NumJobs;
+}
+
+void FCubesAnalysisScheduler::AnalyzeSource(FAnalysisSource& Source) const
+{
+	float* Samples = Source.Window.GetData();
+	for (int32 i = 0; i < WindowSize; ++i)
+	{
+		Samples[i] *= WindowTable[i];
+	}
+	Source.FFT->ForwardRealToComplex(Samples, Source.Spectrum.GetData());
+
+	// Sum each band's bins into the back buffer
+	const float* Spectrum = Source.Spectrum.GetData();
+	TArray<float>& BackBands = Source.Bands[Source.FrontIndex ^ 1];
+	const int32 NyquistBin = WindowSize / 2;
+	for (int32 Band = 0; Band < BackBands.Num(); ++Band)
+	{
+		// Bands squeezed past Nyquist read the last bin
+		const int32 BandFirstBin = FMath::Min(Source.BandEdges[Band], NyquistBin);
+		const int32 BandEndBin = FMath::Max(Source.BandEdges[Band + 1], BandFirstBin + 1);
+		float Power = 0.f;
+		for (int32 Bin = BandFirstBin; Bin < BandEndBin; ++Bin)
+		{
+			const float Real = Spectrum[Bin * 2];
+			const float Imag = Spectrum[Bin * 2 + 1];
+			Power += Real * Real + Imag * Imag;
+		}
+		// Normalize so a full scale sine inside the band reads as roughly 1
+		BackBands[Band] = 2.f * FMath::Sqrt(Power * Source.PowerScale) / WindowGain;
+	}
+}
+
+void FCubesAnalysisScheduler::LaunchAnalysis()
+{
+	if (IsBusy())
+	{
+		return;
+	}
+	PendingAnalysis = UE::Tasks::Launch(UE_SOURCE_LOCATION, [this]() { Analyze(); });
+}
+
+bool FCubesAnalysisScheduler::IsBusy() const
+{
+	return PendingAnalysis.IsValid() && !PendingAnalysis.IsCompleted();
+}
+
+void FCubesAnalysisScheduler::Wait()
+{
+	if (PendingAnalysis.IsValid())
+	{
+		PendingAnalysis.Wait();
+	}
+}
+
+void FCubesAnalysisScheduler::Publish(TArray<int32>& OutUpdatedSources)
+{
+	check(!IsBusy());
+	OutUpdatedSources.Reset();
+	for (int32 SourceId = 0; SourceId < Sources.Num(); ++SourceId)
+	{
+		FAnalysisSource* Source = Sources[SourceId].Get();
+		if (Source && Source->bPendingPublish)
+		{
+			Source->FrontIndex ^= 1;
+			Source->bPendingPublish = false;
+			OutUpdatedSources.Add(SourceId);
+		}
+	}
+}
+
+void FCubesAnalysisScheduler::RunBenchmark(int32 MaxSources, int32 NumPasses)
+{
+	MaxSources = FMath::Max(MaxSources, 1);
+	NumPasses = FMath::Max(NumPasses, 1);
+
+	const int32 BenchmarkBands = 48;
+	FCubesAnalysisScheduler Scheduler(CubesAnalysis::DefaultSampleRate, MaxSources);
+
+	// One window of noise, pushed to every source before each pass
+	TArray<float> Noise;
+	Noise.SetNumUninitialized(Scheduler.WindowSize);
+	for (float& Sample : Noise)
+	{
+		Sample = FMath::FRandRange(-1.f, 1.f);
+	}
+
+	// 1, 2, 4... up to MaxSources, which is always measured
+	TArray<int32> SourceCounts;
+	for (int32 Count = 1; Count < MaxSources; Count *= 2)
+	{
+		SourceCounts.Add(Count);
+	}
+	SourceCounts.Add(MaxSources);
+
+	// 1, 2, 4... threads up to every worker plus the calling thread
+	const int32 MaxThreads = FTaskGraphInterface::Get().GetNumWorkerThreads() + 1;
+	TArray<int32> ThreadCounts;
+	for (int32 Count = 1; Count < MaxThreads; Count *= 2)
+	{
+		ThreadCounts.Add(Count);
+	}
+	ThreadCounts.Add(MaxThreads);
+
+	UE_LOG(LogTemp, Log, TEXT("Cube analysis benchmark: %d bands, %d point FFT, %d passes, up to %d threads (limit cores with -corelimit=N)"),
+		BenchmarkBands, Scheduler.WindowSize, NumPasses, MaxThreads);
+
+	TArray<int32> Updated;
+	for (int32 NumBenchmarkSources : SourceCounts)
+	{
+		while (Scheduler.GetNumSources() < NumBenchmarkSources)
+		{
+			if (Scheduler.AddSource(BenchmarkBands) == INDEX_NONE)
+			{
+				return;
+			}
+		}
+
+		auto RunPass = [&Scheduler, &Noise, &Updated, NumBenchmarkSources](int32 NumThreads)
+		{
+			for (int32 SourceId = 0; SourceId < NumBenchmarkSources; ++SourceId)
+			{
+				Scheduler.PushAudio(SourceId, Noise.GetData(), Noise.Num());
+			}
+			const double StartTime = FPlatformTime::Seconds();
+			Scheduler.Analyze(NumThreads);
+			const double Seconds = FPlatformTime::Seconds() - StartTime;
+			Scheduler.Publish(Updated);
+			return Seconds;
+		};
+
+		FString Line = FString::Printf(TEXT("  %2d sources:"), NumBenchmarkSources);
+		double SingleThreadSeconds = 0.0;
+		for (int32 NumThreads : ThreadCounts)
+		{
+			// Untimed warm-up so every measurement starts with warm caches and awake workers
+			RunPass(NumThreads);
+
+			double Seconds = 0.0;
+			for (int32 Pass = 0; Pass < NumPasses; ++Pass)
+			{
+				Seconds += RunPass(NumThreads);
+			}
+			if (NumThreads == 1)
+			{
+				SingleThreadSeconds = Seconds;
+			}
+			Line += FString::Printf(TEXT(" | %2d threads %10.1f windows/s %.2fx"), NumThreads,
+				(double)NumBenchmarkSources * NumPasses / Seconds, SingleThreadSeconds / Seconds);
+		}
+		UE_LOG(LogTemp, Log, TEXT("%s"), *Line);
+	}
+}
+
+#pragma endregion
+
+#pragma region Submix Feed
+
+/**
+* Mixes a submix down to mono and pushes it to one scheduler source from the audio render thread.
+* That thread is the source's only producer; the lock is only contended while the feed is being deactivated.
+*/
+class FCubesAnalysisSubmixListener : public ISubmixBufferListener
+{
+public:
+	FCubesAnalysisSubmixListener(FCubesAnalysisScheduler& InScheduler, int32 InSourceId, USoundSubmix* InSubmix)
+		: Scheduler(InScheduler), SourceId(InSourceId), Submix(InSubmix) {};
+
+	virtual void OnNewSubmixBuffer(const USoundSubmix* OwningSubmix, float* AudioData, int32 NumSamples, int32 NumChannels, const int32 SampleRate, double AudioClock) override
+	{
+		FScopeLock Lock(&FeedLock);
+		if (!bActive || NumChannels <= 0)
+		{
+			return;
+		}
+
+		const int32 NumFrames = NumSamples / NumChannels;
+		const float ChannelGain = 1.f / NumChannels;
+		Mono.SetNumUninitialized(NumFrames, false);
+		for (int32 Frame = 0; Frame < NumFrames; ++Frame)
+		{
+			const float* FrameSamples = AudioData + Frame * NumChannels;
+			float Sum = 0.f;
+			for (int32 Channel = 0; Channel < NumChannels; ++Channel)
+			{
+				Sum += FrameSamples[Channel];
+			}
+			Mono[Frame] = Sum * ChannelGain;
+		}
+		Scheduler.PushAudio(SourceId, Mono.GetData(), NumFrames);
+	}
+
+	// Stop pushing, once this returns the source can safely be removed
+	void Deactivate()
+	{
+		FScopeLock Lock(&FeedLock);
+		bActive = false;
+	}
+
+	USoundSubmix* GetSubmix() const { return Submix.Get(); }
+
+private:
+	FCubesAnalysisScheduler& Scheduler;
+	const int32 SourceId;
+	TWeakObjectPtr<USoundSubmix> Submix;
+
+	FCriticalSection FeedLock;
+	bool bActive = true;
+
+	// Mono mixdown, only touched on the audio render thread
+	TArray<float> Mono;
+};
+
+#pragma endregion
+
+#pragma region Subsystem
+
+void UCubesAnalysisSubsystem::Initialize(FSubsystemCollectionBase& Collection)
+{
+	Super::Initialize(Collection);
+
+	float SampleRate = CubesAnalysis::DefaultSampleRate;
+	UWorld* CurrentWorld = GetWorld();
+	if (CurrentWorld && CurrentWorld->GetAudioDeviceRaw())
+	{
+		SampleRate = CurrentWorld->GetAudioDeviceRaw()->GetSampleRate();
+	}
+	Scheduler = MakeUnique<FCubesAnalysisScheduler>(SampleRate);
+}
+
+void UCubesAnalysisSubsystem::Deinitialize()
+{
+	TArray<int32> SourceHandles;
+	BoundSpawners.GetKeys(SourceHandles);
+	for (int32 SourceHandle : SourceHandles)
+	{
+		UnregisterSource(SourceHandle);
+	}
+
+	// Waits for any in flight pass
+	Scheduler.Reset();
+
+	Super::Deinitialize();
+}
+
+void UCubesAnalysisSubsystem::Tick(float DeltaTime)
+{
+	Super::Tick(DeltaTime);
+
+	// Drop retired feeds the audio thread is done with, see UnregisterSource
+	RetiredSubmixListeners.RemoveAllSwap([](const TSharedPtr<FCubesAnalysisSubmixListener, ESPMode::ThreadSafe>& Listener)
+		{
+			return Listener.GetSharedReferenceCount() == 1;
+		});
+
+	// Previous pass is still running, check again next frame
+	if (Scheduler->IsBusy())
+	{
+		return;
+	}
+
+	// Free the slots of spawners that went away without unregistering
+	TArray<int32, TInlineAllocator<4>> StaleSources;
+	for (const TPair<int32, TWeakObjectPtr<ACubesSpawner>>& Bound : BoundSpawners)
+	{
+		if (!Bound.Value.IsValid())
+		{
+			StaleSources.Add(Bound.Key);
+		}
+	}
+	for (int32 SourceHandle : StaleSources)
+	{
+		UnregisterSource(SourceHandle);
+	}
+
+	if (Scheduler->GetNumSources() == 0)
+	{
+		return;
+	}
+
+	Scheduler->Publish(UpdatedSources);
+	for (int32 SourceHandle : UpdatedSources)
+	{
+		ACubesSpawner* Spawner = BoundSpawners.FindRef(SourceHandle).Get();
+		if (IsValid(Spawner))
+		{
+			Spawner->ApplyBandAnalysis(*Scheduler->GetBands(SourceHandle));
+		}
+	}
+
+	Scheduler->LaunchAnalysis();
+}
+
+TStatId UCubesAnalysisSubsystem::GetStatId() const
+{
+	RETURN_QUICK_DECLARE_CYCLE_STAT(UCubesAnalysisSubsystem, STATGROUP_Tickables);
+}
+
+int32 UCubesAnalysisSubsystem::RegisterSource(ACubesSpawner* Spawner, USoundSubmix* Submix)
+{
+	if (!IsValid(Spawner))
+	{
+		return INDEX_NONE;
+	}
+	for (const TPair<int32, TWeakObjectPtr<ACubesSpawner>>& Bound : BoundSpawners)
+	{
+		if (Bound.Value.Get() == Spawner)
+		{
+			UE_LOG(LogTemp, Warning, TEXT("%s is already bound to analysis source %d"), *Spawner->GetName(), Bound.Key);
+			return INDEX_NONE;
+		}
+	}
+
+	// Sources can only be added between passes
+	Scheduler->Wait();
+	const int32 SourceHandle = Scheduler->AddSource(Spawner->SpawnFrequencyBandsAmount);
+	if (SourceHandle == INDEX_NONE)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("No free analysis source for %s"), *Spawner->GetName());
+		return INDEX_NONE;
+	}
+	BoundSpawners.Add(SourceHandle, Spawner);
+	Spawner->AnalysisSourceHandle = SourceHandle;
+
+	FAudioDevice* AudioDevice = GetWorld()->GetAudioDeviceRaw();
+	if (IsValid(Submix) && AudioDevice)
+	{
+		TSharedPtr<FCubesAnalysisSubmixListener, ESPMode::ThreadSafe> Listener = MakeShared<FCubesAnalysisSubmixListener, ESPMode::ThreadSafe>(*Scheduler, SourceHandle, Submix);
+		AudioDevice->RegisterSubmixBufferListener(Listener.Get(), Submix);
+		SubmixListeners.Add(SourceHandle, Listener);
+	}
+	return SourceHandle;
+}
+
+void UCubesAnalysisSubsystem::UnregisterSource(int32 SourceHandle)
+{
+	TSharedPtr<FCubesAnalysisSubmixListener, ESPMode::ThreadSafe> Listener;
+	if (SubmixListeners.RemoveAndCopyValue(SourceHandle, Listener))
+	{
+		// Stop the audio render thread from pushing before the source goes away
+		Listener->Deactivate();
+		FAudioDevice* AudioDevice = GetWorld() ? GetWorld()->GetAudioDeviceRaw() : nullptr;
+		if (AudioDevice)
+		{
+			AudioDevice->UnregisterSubmixBufferListener(Listener.Get(), Listener->GetSubmix());
+		}
+
+		// Audio thread commands run in order, so once this one has run (and dropped its reference) the unregister
+		// above is done and the render thread can't be inside the listener anymore. Tick prunes it from there.
+		FAudioThread::RunCommandOnAudioThread([ListenerFence = Listener]() {});
+		RetiredSubmixListeners.Add(Listener);
+	}
+
+	Scheduler->RemoveSource(SourceHandle);
+
+	TWeakObjectPtr<ACubesSpawner> Spawner;
+	if (BoundSpawners.RemoveAndCopyValue(SourceHandle, Spawner) && Spawner.IsValid())
+	{
+		Spawner->AnalysisSourceHandle = INDEX_NONE;
+	}
+}
+
+int32 UCubesAnalysisSubsystem::PushSourceAudio(int32 SourceHandle, const TArray<float>& Samples)
+{
+	// The audio render thread already produces for this source, a second producer would corrupt its input
+	if (SubmixListeners.Contains(SourceHandle))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Analysis source %d is fed by its submix, ignoring pushed audio"), SourceHandle);
+		return 0;
+	}
+	return Scheduler->PushAudio(SourceHandle, Samples.GetData(), Samples.Num());
+}
+
+TArray<float> UCubesAnalysisSubsystem::GetSourceBands(int32 SourceHandle) const
+{
+	const TArray<float>* Bands = Scheduler->GetBands(SourceHandle);
+	return Bands ? *Bands : TArray<float>();
+}
+
+#pragma endregion
@@ -0,0 +1,218 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Subsystems/WorldSubsystem.h"
+#include "Tasks/Task.h"
+#include "DSP/Dsp.h"
+#include "DSP/AlignedBuffer.h"
+#include "DSP/FFTAlgorithm.h"
+
+#include "CubesAnalysisScheduler.generated.h"
+
+class ACubesSpawner;
+class USoundSubmix;
+class FCubesAnalysisSubmixListener;
+
+/**
+* Native band analysis for several audio sources at once.
+* Each analysis pass takes the newest window of every ready source and runs one fixed-size job per source through
+* ParallelFor, so idle task graph workers steal jobs from busy ones. A job is a real FFT of the window plus the band sums.
+* Every band sums the power of the bins between its edges. Below Nyquist each band owns at least one bin of its own,
+* bands squeezed past Nyquist share the last bin.
+* Results are double buffered per source: workers only write the back buffer, and Publish() swaps it to the front
+* on the owning thread once the pass has completed, so readers never take a lock.
+* Not a UObject so it can be driven headless (see RunBenchmark).
+*/
+class AUDIOSYNESTHESIATEST_API FCubesAnalysisScheduler
+{
+public:
+	// InWindowSize is rounded up to a power of two for the FFT
+	FCubesAnalysisScheduler(float InSampleRate, int32 InMaxSources = 16, int32 InWindowSize = 1024);
+	~FCubesAnalysisScheduler();
+
+#pragma region Sources
+public:
+	/**
+	* Add a source, must not be called while a pass is in flight
+	* @param NumBands The amount of frequency bands to analyze for this source
+	* @return The source id, or INDEX_NONE if every slot is taken or no FFT is available
+	*/
+	int32 AddSource(int32 NumBands);
+
+	/**
+	* Remove a source, waits for any in flight pass. Stop pushing audio to it first.
+	* @param SourceId The id returned from AddSource
+	*/
+	void RemoveSource(int32 SourceId);
+
+	/**
+	* Feed mono samples to a source. Safe from one producer thread per source (e.g. the audio render thread).
+	* Analysis only ever looks at the newest window, older samples are skipped.
+	* @return The amount of samples accepted, excess is dropped once the source's input buffer is full
+	*/
+	int32 PushAudio(int32 SourceId, const float* Samples, int32 NumSamples);
+
+	/** Latest published band amplitudes of a source, or nullptr for an invalid id */
+	const TArray<float>* GetBands(int32 SourceId) const;
+
+	int32 GetNumSources() const { return NumSources; }
+#pragma endregion
+
+#pragma region Analysis
+public:
+	/**
+	* Run one analysis pass on the calling thread, fanning jobs out to the task graph workers
+	* @param MaxConcurrency At most this many threads run jobs at once, 0 for no limit and 1 for the calling thread only
+	* @return The amount of sources analyzed in this pass
+	*/
+	int32 Analyze(int32 MaxConcurrency = 0);
+
+	/** Run Analyze() on a background task, does nothing if a pass is already in flight */
+	void LaunchAnalysis();
+
+	/** Is a background pass still running? */
+	bool IsBusy() const;
+
+	/** Block until the in flight pass, if any, has completed */
+	void Wait();
+
+	/**
+	* Swap freshly analyzed bands to the front. Call from the owning thread while not busy.
+	* @param OutUpdatedSources Ids of the sources that got new bands
+	*/
+	void Publish(TArray<int32>& OutUpdatedSources);
+
+	/**
+	* Log analysis throughput for 1, 2, 4... MaxSources sources, at 1, 2, 4... threads up to every task graph worker.
+	* Each measurement is preceded by an untimed warm-up pass.
+	* @param MaxSources The largest amount of sources to measure, always measured itself
+	* @param NumPasses Analysis passes per measurement
+	*/
+	static void RunBenchmark(int32 MaxSources, int32 NumPasses);
+#pragma endregion
+
+private:
+	struct FAnalysisSource
+	{
+		FAnalysisSource(int32 InWindowSize, int32 InNumBands);
+
+		// Written by a single producer, read by the analysis pass
+		Audio::TCircularAudioBuffer<float> Input;
+
+		// The window popped from Input for the current pass, windowed in place
+		Audio::FAlignedFloatBuffer Window;
+
+		// Interleaved real/imaginary FFT output, WindowSize / 2 + 1 bins
+		Audio::FAlignedFloatBuffer Spectrum;
+
+		// Each source owns its FFT so jobs never share state
+		TUniquePtr<Audio::IFFTAlgorithm> FFT;
+
+		// Brings FFT's power output back to an unscaled DFT
+		float PowerScale = 1.f;
+
+		// Bin edges of every band, band i covers [BandEdges[i], BandEdges[i + 1])
+		TArray<int32> BandEdges;
+
+		// Front/back band amplitudes, see FrontIndex
+		TArray<float> Bands[2];
+
+		int32 FrontIndex = 0;
+
+		// Back buffer holds results that haven't been published yet
+		bool bPendingPublish = false;
+	};
+
+	// One job: window, FFT and sum the bands of a source into its back buffer
+	void AnalyzeSource(FAnalysisSource& Source) const;
+
+	float SampleRate;
+	int32 WindowSize;
+	int32 NumSources;
+
+	// Fixed amount of slots so producers never see the array reallocate
+	TArray<TUniquePtr<FAnalysisSource>> Sources;
+
+	// Hann window, shared by every source
+	TArray<float> WindowTable;
+	float WindowGain;
+
+	// Only touched by the analysis pass
+	TArray<FAnalysisSource*> ReadySources;
+
+	UE::Tasks::FTask PendingAnalysis;
+};
+
+/**
+* Owns the world's FCubesAnalysisScheduler and binds its sources to ACubesSpawners.
+* A source registered with a submix is fed from that submix on the audio render thread, mixed down to mono.
+* Every tick publishes the last completed pass to the bound spawners and launches the next one.
+*/
+UCLASS()
+class AUDIOSYNESTHESIATEST_API UCubesAnalysisSubsystem : public UTickableWorldSubsystem
+{
+	GENERATED_BODY()
+
+#pragma region Basic and Overridden
+public:
+	virtual void Initialize(FSubsystemCollectionBase& Collection) override;
+	virtual void Deinitialize() override;
+	virtual void Tick(float DeltaTime) override;
+	virtual TStatId GetStatId() const override;
+#pragma endregion
+
+#pragma region Sources
+public:
+	/**
+	* Register an analysis source bound to a spawner, analyzing SpawnFrequencyBandsAmount bands
+	* @param Spawner The spawner that receives this source's bands, each spawner can only be bound once
+	* @param Submix The stem to analyze. Leave empty to feed the source through PushSourceAudio instead.
+	* @return Handle of the new source, or -1 on failure
+	*/
+	UFUNCTION(BlueprintCallable, Category = "Analysis")
+	int32 RegisterSource(ACubesSpawner* Spawner, USoundSubmix* Submix = nullptr);
+
+	/**
+	* Unregister a source and stop listening to its submix
+	* @param SourceHandle The handle returned from RegisterSource
+	*/
+	UFUNCTION(BlueprintCallable, Category = "Analysis")
+	void UnregisterSource(int32 SourceHandle);
+
+	/**
+	* Feed mono samples to a source. Rejected for sources registered with a submix, which already have a producer.
+	* @param SourceHandle The handle returned from RegisterSource
+	* @param Samples Mono samples at the audio device's sample rate
+	* @return The amount of samples accepted
+	*/
+	UFUNCTION(BlueprintCallable, Category = "Analysis")
+	int32 PushSourceAudio(int32 SourceHandle, const TArray<float>& Samples);
+
+	/**
+	* Latest published band amplitudes of a source
+	* @param SourceHandle The handle returned from RegisterSource
+	*/
+	UFUNCTION(BlueprintCallable, BlueprintPure, Category = "Analysis")
+	TArray<float> GetSourceBands(int32 SourceHandle) const;
+
+	/** Native access, e.g. to push audio from another producer thread */
+	FCubesAnalysisScheduler& GetScheduler() { return *Scheduler; }
+#pragma endregion
+
+private:
+	TUniquePtr<FCubesAnalysisScheduler> Scheduler;
+
+	// Spawner bound to each source handle
+	TMap<int32, TWeakObjectPtr<ACubesSpawner>> BoundSpawners;
+
+	// Submix feed of each source handle registered with a submix
+	TMap<int32, TSharedPtr<FCubesAnalysisSubmixListener, ESPMode::ThreadSafe>> SubmixListeners;
+
+	// Unregistered feeds, kept alive until the audio thread has processed their unregister, pruned in Tick
+	TArray<TSharedPtr<FCubesAnalysisSubmixListener, ESPMode::ThreadSafe>> RetiredSubmixListeners;
+
+	// Reused by Tick
+	TArray<int32> UpdatedSources;
+};
@@ -3,6 +3,7 @@
 
 #include "CubesSpawner.h"
 #include "AudioSynesthesiaGameModeBase.h"
+#include "CubesAnalysisScheduler.h"
 
 // Only allow with editor, also change here to true/false for debugging
 #define DEBUG (WITH_EDITOR && false)
@@ -51,9 +52,28 @@ void ACubesSpawner::BeginPlay()
 
 	InitSoundObjects();
 
+	// Follow our stem
+	UCubesAnalysisSubsystem* AnalysisSubsystem = GetWorld()->GetSubsystem<UCubesAnalysisSubsystem>();
+	if (IsValid(AnalysisSubmix) && AnalysisSubsystem)
+	{
+		AnalysisSubsystem->RegisterSource(this, AnalysisSubmix);
+	}
+
 	Super::BeginPlay();
 }
 
+void ACubesSpawner::EndPlay(const EEndPlayReason::Type EndPlayReason)
+{
+	// Give our analysis source back
+	UCubesAnalysisSubsystem* AnalysisSubsystem = GetWorld()->GetSubsystem<UCubesAnalysisSubsystem>();
+	if (AnalysisSourceHandle != INDEX_NONE && AnalysisSubsystem)
+	{
+		AnalysisSubsystem->UnregisterSource(AnalysisSourceHandle);
+	}
+
+	Super::EndPlay(EndPlayReason);
+}
+
 // Called every frame
 void ACubesSpawner::Tick(float DeltaTime)
 {
@@ -115,6 +135,9 @@ void ACubesSpawner::InitSoundObjects_Implementation()
 			}
 		}
 	}
+
+	// First beat of history
+	RecordElementSnapshots();
 }
 
 FVector ACubesSpawner::FindBufferedPositionFromGround(FVector CurrentCubePosition, const float GroundBuffer)
@@ -190,6 +213,8 @@ void ACubesSpawner::SpawnSoundObjects_Implementation()
 				++CurrentSpawnIndex;
 			}
 		}
+
+		RecordElementSnapshots();
 	}
 }
 
@@ -241,6 +266,253 @@ void ACubesSpawner::SoundObjectRepositioning(int32 SoundObjectIndex, int32 Spawn
 	SoundElement->SoundObject->SetActorEnableCollision(IsInVisibleRange);
 }
 
+void ACubesSpawner::ApplyBandAnalysis_Implementation(const TArray<float>& BandValues)
+{
+	if (BandValues.Num() == 0)
+	{
+		return;
+	}
+	// Each element follows the band of the spawn location it revolves around
+	for (FSoundSpawnerElement& SoundElement : soundElements)
+	{
+		const float BandValue = BandValues[SoundElement.CurrentSpawnLocationIndex % BandValues.Num()];
+		SoundElement.SetNewDestinationLocationZ(FVector::OneVector + ScaleMultiplier * BandValue);
+	}
+}
+
+#pragma endregion
+
+#pragma region Snapshot History
+
+FSoundElementSnapshot FSoundElementSnapshot::Encode(const FSoundSpawnerElement& Element, const FVector& Origin, const FVector& ScaleMultiplier)
+{
+	const FTransform& Transform = Element.TransformDestination;
+	FSoundElementSnapshot Snapshot;
+	Snapshot.Flags = 0;
+
+	const FVector Offset = (Transform.GetLocation() - Origin) / PositionStep;
+	if (Offset.GetAbsMax() > MAX_int16)
+	{
+		Snapshot.Flags |= Approximate;
+	}
+	Snapshot.X = (int16)FMath::Clamp(FMath::RoundToInt(Offset.X), (int32)MIN_int16, (int32)MAX_int16);
+	Snapshot.Y = (int16)FMath::Clamp(FMath::RoundToInt(Offset.Y), (int32)MIN_int16, (int32)MAX_int16);
+	Snapshot.Z = (int16)FMath::Clamp(FMath::RoundToInt(Offset.Z), (int32)MIN_int16, (int32)MAX_int16);
+
+	// SoundObjectRepositioning points the Z axis from the circle center to the element, within the XZ plane
+	const FQuat Rotation = Transform.GetRotation();
+	if (!Rotation.GetAxisY().Equals(FVector(0.f, 1.f, 0.f), 1.e-3f))
+	{
+		Snapshot.Flags |= Approximate;
+	}
+	const FVector CircleDirection = Rotation.GetAxisZ();
+	const float Turns = FMath::Atan2(CircleDirection.Z, CircleDirection.X) / UE_TWO_PI;
+	Snapshot.Angle = (uint16)(FMath::RoundToInt(Turns * 65536.f) & 0xFFFF);
+
+	// Recover the level along the dominant ScaleMultiplier axis
+	float Level = 0.f;
+	const int32 Axis = FMath::Abs(ScaleMultiplier.X) >= FMath::Abs(ScaleMultiplier.Y)
+		? (FMath::Abs(ScaleMultiplier.X) >= FMath::Abs(ScaleMultiplier.Z) ? 0 : 2)
+		: (FMath::Abs(ScaleMultiplier.Y) >= FMath::Abs(ScaleMultiplier.Z) ? 1 : 2);
+	if (!FMath::IsNearlyZero(ScaleMultiplier[Axis]))
+	{
+		Level = (Transform.GetScale3D()[Axis] - 1.f) / ScaleMultiplier[Axis];
+	}
+	Snapshot.ScaleLevel = (uint8)FMath::RoundToInt(FMath::Clamp(Level / MaxScaleLevel, 0.f, 1.f) * 255.f);
+
+	// Within half a level step of what Decode gives back
+	const FVector DecodedScale = FVector::OneVector + ScaleMultiplier * (Snapshot.ScaleLevel * (MaxScaleLevel / 255.f));
+	const float ScaleTolerance = ScaleMultiplier.GetAbsMax() * (MaxScaleLevel / 255.f) * 0.5f + 1.e-3f;
+	if (!DecodedScale.Equals(Transform.GetScale3D(), ScaleTolerance))
+	{
+		Snapshot.Flags |= Approximate;
+	}
+
+	if (Element.bUsed)
+	{
+		Snapshot.Flags |= Used;
+	}
+	if (IsValid(Element.SoundObject) && !Element.SoundObject->IsHidden())
+	{
+		Snapshot.Flags |= Visible;
+	}
+	return Snapshot;
+}
+
+FTransform FSoundElementSnapshot::Decode(const FVector& Origin, const FVector& ScaleMultiplier) const
+{
+	return Compose(Origin + FVector(X, Y, Z) * PositionStep, Angle, ScaleLevel, ScaleMultiplier);
+}
+
+FTransform FSoundElementSnapshot::Compose(const FVector& Location, float AngleSteps, float ScaleLevelSteps, const FVector& ScaleMultiplier)
+{
+	// Same as MakeFromYZ(world Y, circle direction): a turn around Y that brings Z onto (cos, 0, sin) of the angle
+	const float Radians = AngleSteps * (UE_TWO_PI / 65536.f);
+	const FQuat Rotation(FVector(0.f, 1.f, 0.f), UE_HALF_PI - Radians);
+
+	const FVector Scale = FVector::OneVector + ScaleMultiplier * (ScaleLevelSteps * (MaxScaleLevel / 255.f));
+	return FTransform(Rotation, Location, Scale);
+}
+
+void ACubesSpawner::RecordElementSnapshots()
+{
+	const int32 NumElements = soundElements.Num();
+	const int32 HistoryLength = FMath::Max(SnapshotHistoryLength, 2);
+
+	// (Re)build the ring when the pool or history size changed, old beats can't be compared anymore
+	if (SnapshotStride != NumElements || SnapshotBeats.Num() != HistoryLength)
+	{
+		SnapshotStride = NumElements;
+		SnapshotHistory.SetNumUninitialized(NumElements * HistoryLength);
+		SnapshotBeats.SetNumUninitialized(HistoryLength);
+		SnapshotHead = 0;
+		NumSnapshotBeats = 0;
+	}
+
+	FSnapshotBeat& Beat = SnapshotBeats[SnapshotHead];
+	Beat.Time = GetWorld()->GetTimeSeconds();
+	// Rebase on the elements' own spawn locations, the spawner itself stays behind as the spawn locations grow
+	Beat.Origin = GetActorLocation();
+	if (NumElements > 0 && SpawnLocations.IsValidIndex(soundElements[0].CurrentSpawnLocationIndex))
+	{
+		Beat.Origin = SpawnLocations[soundElements[0].CurrentSpawnLocationIndex];
+	}
+
+	FSoundElementSnapshot* BeatSnapshots = SnapshotHistory.GetData() + SnapshotHead * SnapshotStride;
+	for (int32 i = 0; i < NumElements; ++i)
+	{
+		BeatSnapshots[i] = FSoundElementSnapshot::Encode(soundElements[i], Beat.Origin, ScaleMultiplier);
+
+		// Destinations set from BP (e.g. SoundElementSetScale) are expected to fall outside the format, just mention it once
+		if (!bLoggedApproximateSnapshot && (BeatSnapshots[i].Flags & FSoundElementSnapshot::Approximate))
+		{
+			UE_LOG(LogTemp, Verbose, TEXT("%s: sound element %d doesn't fit the snapshot format, its history is approximate"), *GetName(), i);
+			bLoggedApproximateSnapshot = true;
+		}
+	}
+
+	SnapshotHead = (SnapshotHead + 1) % HistoryLength;
+	NumSnapshotBeats = FMath::Min(NumSnapshotBeats + 1, HistoryLength);
+}
+
+int32 ACubesSpawner::GetSnapshotSlot(int32 BeatsAgo) const
+{
+	const int32 HistoryLength = SnapshotBeats.Num();
+	return (SnapshotHead - 1 - BeatsAgo + HistoryLength * 2) % HistoryLength;
+}
+
+TArrayView<const FSoundElementSnapshot> ACubesSpawner::GetElementSnapshots(int32 BeatsAgo) const
+{
+	if (BeatsAgo < 0 || BeatsAgo >= NumSnapshotBeats)
+	{
+		return TArrayView<const FSoundElementSnapshot>();
+	}
+	return TArrayView<const FSoundElementSnapshot>(SnapshotHistory.GetData() + GetSnapshotSlot(BeatsAgo) * SnapshotStride, SnapshotStride);
+}
+
+void ACubesSpawner::CopyElementSnapshots(int32 BeatsAgo, TArray<FSoundElementSnapshot>& OutSnapshots) const
+{
+	const TArrayView<const FSoundElementSnapshot> BeatSnapshots = GetElementSnapshots(BeatsAgo);
+	OutSnapshots.Reset();
+	OutSnapshots.Append(BeatSnapshots.GetData(), BeatSnapshots.Num());
+}
+
+FTransform ACubesSpawner::DecodeElementSnapshot(const FSoundElementSnapshot& Snapshot, int32 BeatsAgo) const
+{
+	if (BeatsAgo < 0 || BeatsAgo >= NumSnapshotBeats)
+	{
+		return FTransform::Identity;
+	}
+	return Snapshot.Decode(SnapshotBeats[GetSnapshotSlot(BeatsAgo)].Origin, ScaleMultiplier);
+}
+
+void ACubesSpawner::FindSnapshotSlots(double Time, int32& OutOlderSlot, int32& OutNewerSlot, float& OutAlpha) const
+{
+	OutOlderSlot = OutNewerSlot = GetSnapshotSlot(0);
+	OutAlpha = 0.f;
+	if (Time >= SnapshotBeats[OutNewerSlot].Time)
+	{
+		return;
+	}
+
+	for (int32 BeatsAgo = 1; BeatsAgo < NumSnapshotBeats; ++BeatsAgo)
+	{
+		OutOlderSlot = GetSnapshotSlot(BeatsAgo);
+		const double OlderTime = SnapshotBeats[OutOlderSlot].Time;
+		if (Time >= OlderTime)
+		{
+			const double NewerTime = SnapshotBeats[OutNewerSlot].Time;
+			OutAlpha = NewerTime > OlderTime ? (float)((Time - OlderTime) / (NewerTime - OlderTime)) : 1.f;
+			return;
+		}
+		OutNewerSlot = OutOlderSlot;
+	}
+
+	// Older than anything we kept, hold the oldest beat
+	OutNewerSlot = OutOlderSlot;
+}
+
+FTransform ACubesSpawner::InterpolateSnapshots(int32 ElementIndex, int32 OlderSlot, int32 NewerSlot, float Alpha) const
+{
+	const FSnapshotBeat& NewerBeat = SnapshotBeats[NewerSlot];
+	const FSoundElementSnapshot& Newer = SnapshotHistory[NewerSlot * SnapshotStride + ElementIndex];
+	if (OlderSlot == NewerSlot)
+	{
+		return Newer.Decode(NewerBeat.Origin, ScaleMultiplier);
+	}
+
+	// Blend the compact values and build a single transform
+	const FSnapshotBeat& OlderBeat = SnapshotBeats[OlderSlot];
+	const FSoundElementSnapshot& Older = SnapshotHistory[OlderSlot * SnapshotStride + ElementIndex];
+	const FVector OlderLocation = OlderBeat.Origin + FVector(Older.X, Older.Y, Older.Z) * FSoundElementSnapshot::PositionStep;
+	const FVector NewerLocation = NewerBeat.Origin + FVector(Newer.X, Newer.Y, Newer.Z) * FSoundElementSnapshot::PositionStep;
+
+	// Wrapping difference, the shortest way around the circle
+	const int16 AngleDelta = (int16)(uint16)(Newer.Angle - Older.Angle);
+
+	return FSoundElementSnapshot::Compose(
+		FMath::Lerp(OlderLocation, NewerLocation, (double)Alpha),
+		Older.Angle + AngleDelta * Alpha,
+		FMath::Lerp((float)Older.ScaleLevel, (float)Newer.ScaleLevel, Alpha),
+		ScaleMultiplier);
+}
+
+FTransform ACubesSpawner::GetInterpolatedElementTransform(int32 ElementIndex, float Time) const
+{
+	if (NumSnapshotBeats == 0 || ElementIndex < 0 || ElementIndex >= SnapshotStride)
+	{
+		return FTransform::Identity;
+	}
+
+	int32 OlderSlot, NewerSlot;
+	float Alpha;
+	FindSnapshotSlots(Time, OlderSlot, NewerSlot, Alpha);
+	return InterpolateSnapshots(ElementIndex, OlderSlot, NewerSlot, Alpha);
+}
+
+void ACubesSpawner::GetInterpolatedElementTransforms(float Time, TArray<FTransform>& OutTransforms, TArray<bool>& OutVisible) const
+{
+	OutTransforms.Reset();
+	OutVisible.Reset();
+	if (NumSnapshotBeats == 0)
+	{
+		return;
+	}
+
+	int32 OlderSlot, NewerSlot;
+	float Alpha;
+	FindSnapshotSlots(Time, OlderSlot, NewerSlot, Alpha);
+
+	OutTransforms.SetNumUninitialized(SnapshotStride);
+	OutVisible.SetNumUninitialized(SnapshotStride);
+	const FSoundElementSnapshot* NewerSnapshots = SnapshotHistory.GetData() + NewerSlot * SnapshotStride;
+	for (int32 i = 0; i < SnapshotStride; ++i)
+	{
+		OutTransforms[i] = InterpolateSnapshots(i, OlderSlot, NewerSlot, Alpha);
+		OutVisible[i] = NewerSnapshots[i].IsVisible();
+	}
+}
+
 #pragma endregion
 
 #pragma region Spawn Locations
@@ -15,6 +15,7 @@
 
 class UEditorActorSubsystem;
 class AAudioSynesthesiaGameModeBase;
+class USoundSubmix;
 
 DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FCubeSpawnerSpawnLocationsIncreased, UPARAM(ref) TArray<FVector>&, NewSpawnLocations);
 
@@ -59,6 +60,75 @@ public:
 	}
 };
 
+/**
+* Compact per-beat copy of a FSoundSpawnerElement's destination, 10 bytes instead of a double precision FTransform.
+* The format only holds the destinations SoundObjectRepositioning and ApplyBandAnalysis produce:
+* - Position is relative to the beat's origin (the first element's spawn location), within +-65534 units in 2 unit steps
+* - Rotation is only the angle of the Z axis on the spawn circle, any rotation whose Y axis isn't world Y is lost
+* - Scale is only a 0-4 level along ScaleMultiplier, read from its dominant axis
+* Anything else, e.g. set through SoundElementSetTransformDestination, is flagged Approximate and decodes differently.
+* Blueprints read them through ACubesSpawner::CopyElementSnapshots and DecodeElementSnapshot.
+*/
+USTRUCT(BlueprintType)
+struct FSoundElementSnapshot
+{
+	GENERATED_BODY()
+
+public:
+	enum EFlags : uint8
+	{
+		Used = 1 << 0,
+		Visible = 1 << 1,
+		// The destination didn't fit the format, Decode returns an approximation
+		Approximate = 1 << 2,
+	};
+
+	// Position relative to the beat's origin, in PositionStep units
+	UPROPERTY()
+	int16 X = 0;
+
+	UPROPERTY()
+	int16 Y = 0;
+
+	UPROPERTY()
+	int16 Z = 0;
+
+	// Angle on the spawn circle, a full turn over the uint16 range
+	UPROPERTY()
+	uint16 Angle = 0;
+
+	// Scale = 1 + ScaleMultiplier * level, a full byte being MaxScaleLevel
+	UPROPERTY(BlueprintReadOnly, Category = "SoundSpawnerElement")
+	uint8 ScaleLevel = 0;
+
+	// EFlags
+	UPROPERTY(BlueprintReadOnly, Category = "SoundSpawnerElement")
+	uint8 Flags = 0;
+
+	static constexpr float PositionStep = 2.f;
+	static constexpr float MaxScaleLevel = 4.f;
+
+	/**
+	* Quantize an element's destination
+	* @param Origin The location positions are relative to
+	* @param ScaleMultiplier The spawner's ScaleMultiplier
+	*/
+	static FSoundElementSnapshot Encode(const FSoundSpawnerElement& Element, const FVector& Origin, const FVector& ScaleMultiplier);
+
+	// Rebuild the destination transform, using the same Origin and ScaleMultiplier it was encoded with
+	FTransform Decode(const FVector& Origin, const FVector& ScaleMultiplier) const;
+
+	/**
+	* Build a destination transform from unpacked, possibly interpolated, snapshot values
+	* @param AngleSteps Angle in uint16 steps, may fall outside the uint16 range
+	* @param ScaleLevelSteps Scale level in byte steps
+	*/
+	static FTransform Compose(const FVector& Location, float AngleSteps, float ScaleLevelSteps, const FVector& ScaleMultiplier);
+
+	bool IsVisible() const { return (Flags & Visible) != 0; }
+};
+static_assert(sizeof(FSoundElementSnapshot) == 10, "FSoundElementSnapshot should stay packed");
+
 UCLASS()
 class AUDIOSYNESTHESIATEST_API ACubesSpawner : public AActor
 {
@@ -72,6 +142,9 @@ protected:
 	// Called when the game starts or when spawned
 	virtual void BeginPlay() override;
 
+	// Called when the actor is removed or the level ends
+	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
+
 public:	
 	// Called every frame
 	virtual void Tick(float DeltaTime) override;
@@ -105,6 +178,94 @@ public:
 	int32 PoolSize;
 #pragma endregion
 
+#pragma region Snapshot History
+public:
+	/** How many beats of element snapshots we keep to interpolate against */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Pools|History", meta = (ClampMin = "2", UIMin = "2"))
+	int32 SnapshotHistoryLength = 4;
+
+	/** Record the current destination of every sound element as the newest beat in the history */
+	UFUNCTION(BlueprintCallable, Category = "Pools|History")
+	void RecordElementSnapshots();
+
+	/**
+	* Sample an element's destination from the history, blending the two recorded beats around Time.
+	* Sample slightly in the past (e.g. now minus one beat) for smooth motion; sampling by time also catches up after frame drops.
+	* @param ElementIndex Index into soundElements
+	* @param Time World time in seconds, clamped to the recorded range
+	* @return The interpolated transform, identity if nothing has been recorded
+	*/
+	UFUNCTION(BlueprintCallable, BlueprintPure, Category = "Pools|History")
+	FTransform GetInterpolatedElementTransform(int32 ElementIndex, float Time) const;
+
+	/**
+	* Copy the compact snapshots of one recorded beat, in soundElements order
+	* @param BeatsAgo 0 is the newest beat
+	* @param OutSnapshots Filled with the beat's snapshots, empty if that beat hasn't been recorded
+	*/
+	UFUNCTION(BlueprintCallable, Category = "Pools|History")
+	void CopyElementSnapshots(int32 BeatsAgo, TArray<FSoundElementSnapshot>& OutSnapshots) const;
+
+	/**
+	* Rebuild the destination transform of a snapshot copied from a recorded beat
+	* @param Snapshot The snapshot, from CopyElementSnapshots
+	* @param BeatsAgo The beat it was copied from
+	*/
+	UFUNCTION(BlueprintCallable, BlueprintPure, Category = "Pools|History")
+	FTransform DecodeElementSnapshot(const FSoundElementSnapshot& Snapshot, int32 BeatsAgo) const;
+
+	/** Was the element visible when the snapshot was taken? */
+	UFUNCTION(BlueprintCallable, BlueprintPure, Category = "Pools|History")
+	static bool IsElementSnapshotVisible(const FSoundElementSnapshot& Snapshot) { return Snapshot.IsVisible(); }
+
+	/**
+	* Native bulk version of GetInterpolatedElementTransform for every sound element.
+	* Interpolates the compact values and builds one transform per element; the arrays keep their allocation between calls.
+	* @param Time World time in seconds, clamped to the recorded range
+	* @param OutTransforms Interpolated transform per element
+	* @param OutVisible Visibility per element, taken from the newer of the two beats
+	*/
+	void GetInterpolatedElementTransforms(float Time, TArray<FTransform>& OutTransforms, TArray<bool>& OutVisible) const;
+
+	/**
+	* Raw snapshots of one recorded beat, contiguous in soundElements order
+	* @param BeatsAgo 0 is the newest beat
+	* @return Empty if that beat hasn't been recorded
+	*/
+	TArrayView<const FSoundElementSnapshot> GetElementSnapshots(int32 BeatsAgo) const;
+
+private:
+	struct FSnapshotBeat
+	{
+		// World time the beat was recorded at
+		double Time;
+
+		// Location the beat's positions are relative to, the first element's spawn location
+		FVector Origin;
+	};
+
+	// Ring slot of a recorded beat, BeatsAgo 0 being the newest
+	int32 GetSnapshotSlot(int32 BeatsAgo) const;
+
+	// Blend two recorded beats of one element
+	FTransform InterpolateSnapshots(int32 ElementIndex, int32 OlderSlot, int32 NewerSlot, float Alpha) const;
+
+	// Find the recorded beats around Time, both slots are equal when Time is outside the recorded range
+	void FindSnapshotSlots(double Time, int32& OutOlderSlot, int32& OutNewerSlot, float& OutAlpha) const;
+
+	// Beat-major ring, SnapshotBeats.Num() slots of SnapshotStride snapshots each
+	TArray<FSoundElementSnapshot> SnapshotHistory;
+	TArray<FSnapshotBeat> SnapshotBeats;
+	int32 SnapshotStride = 0;
+
+	// Next slot to write and how many slots hold a recorded beat
+	int32 SnapshotHead = 0;
+	int32 NumSnapshotBeats = 0;
+
+	// Approximate snapshots are only logged once per spawner
+	bool bLoggedApproximateSnapshot = false;
+#pragma endregion
+
 #pragma region SoundSpawnerElements Wrappers
 public:
 	/**
@@ -204,6 +365,21 @@ public:
 
 	UFUNCTION(BlueprintCallable, BlueprintPure, Category = "Spawning")
 	int32 GetNearestSpawnIndex() { return NearestSpawnIndex;  }
+
+	/**
+	* Called by UCubesAnalysisSubsystem with freshly analyzed bands for the source bound to this spawner
+	* @param BandValues Band amplitudes, one per SpawnFrequencyBandsAmount
+	*/
+	UFUNCTION(BlueprintCallable, BlueprintNativeEvent, Category = "Spawning")
+	void ApplyBandAnalysis(const TArray<float>& BandValues);
+
+	/** The stem this spawner follows. When set, the spawner registers with UCubesAnalysisSubsystem for its lifetime. */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Spawning")
+	USoundSubmix* AnalysisSubmix;
+
+	/** Our source in UCubesAnalysisSubsystem, kept up to date by the subsystem. -1 when not registered */
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Spawning")
+	int32 AnalysisSourceHandle = INDEX_NONE;
 #pragma endregion
 
 #pragma region SpawnLocations